@@ -2,8 +2,27 @@
 #include <linux/module.h>
 #include <linux/kernel.h>
 #include <linux/gpio.h>
+#include <linux/gpio/consumer.h>
+#include <linux/gpio/driver.h>
 #include <linux/interrupt.h>
-#include <linux/time64.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/mutex.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/completion.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/pwm.h>
+#include <linux/leds.h>
+#include <linux/platform_device.h>
+#include <linux/version.h>
+#include <linux/miscdevice.h>
+#include <linux/fs.h>
+#include <linux/uaccess.h>
+#include <linux/wait.h>
+#include <linux/mm.h>
+#include <linux/io.h>
 
 #define MODULE_NAME "pwm_led_module"
 
@@ -11,14 +30,41 @@
 #define UP_BUTTON_GPIO 24
 #define LED_GPIO 18
 
-#define BUTTON_DEBOUNCE 200 /* milliseconds */
+#define MAX_LED_CHANNELS 32
+#define MAX_LED_EDGES (4 * MAX_LED_CHANNELS)
+
+#define BUTTON_DEBOUNCE_DEFAULT (200 * NSEC_PER_MSEC) /* nanoseconds */
+#define BUTTON_SAMPLES 5
+#define BUTTON_SAMPLE_INTERVAL 1000 /* microseconds */
+
+/* The FSM state and the button level, packed into one atomic word */
+#define LED_FSM_STATE_BITS 2
+#define LED_FSM(state, level) ((level) << LED_FSM_STATE_BITS | (state))
+#define LED_FSM_STATE(fsm) ((fsm) & ((1 << LED_FSM_STATE_BITS) - 1))
+#define LED_FSM_LEVEL(fsm) ((fsm) >> LED_FSM_STATE_BITS)
 
 #define LED_MIN_LEVEL 0
 #define LED_MAX_LEVEL_DEFAULT 5
+#define LED_MAX_LEVEL_LIMIT (INT_MAX >> LED_FSM_STATE_BITS)
 #define PULSE_FREQUENCY_DEFAULT 100000 /* nanoseconds */
+#define DITHER_QUANTUM_DEFAULT 1000 /* nanoseconds */
+
+#define PWM_THREAD_PRIORITY (MAX_RT_PRIO / 2)
+
+#define CALIBRATION_SAMPLES 64
+#define CALIBRATION_INTERVAL 100000 /* nanoseconds */
+#define PRECISION_MARGIN_MAX 50000 /* nanoseconds */
+
+#define DITHER_SHIFT 16
+#define DITHER_ONE (1 << DITHER_SHIFT)
 
 #define LOW 0
-#define HIGH 1
+
+#define LED_PERIOD_START -1
+
+#define LED_SCHEDULE_FRESH 0x4 /* set on the middle buffer index */
+
+#define LED_STREAM_DEPTH 16 /* samples, a power of two */
 
 enum direction {
 	INPUT,
@@ -39,6 +85,111 @@ enum led_state {
 	NUM_STATES
 };
 
+/*
+ * The periods in which a mask applies. With dithering, a channel's HIGH time
+ * is extended by a quantum in some periods (EXTRA) but not in others (BASE).
+ */
+enum dither_kind {
+	DITHER_ALL,
+	DITHER_BASE,
+	DITHER_EXTRA,
+	NUM_DITHER_KINDS
+};
+
+/*
+ * /dev/pwm-led may only be opened once. Once the first sample has been
+ * written the stream is ACTIVE, and after the device is closed the engine
+ * drops the samples left (CLOSING) before it can be opened again.
+ */
+enum led_stream_state {
+	LED_STREAM_IDLE,
+	LED_STREAM_OPEN,
+	LED_STREAM_ACTIVE,
+	LED_STREAM_CLOSING
+};
+
+/*
+ * A push-button, the FSM event it triggers and the time (CLOCK_MONOTONIC,
+ * ns) of its last interrupt. stamped tells the IRQ thread that the handler
+ * has taken the time. Unless its GPIO controller debounces it (hw_debounce),
+ * its IRQ is masked for the debounce time after every press and unmasked
+ * again by debounce_work.
+ */
+struct led_button {
+	int gpio;
+	int irq;
+	enum event event;
+	bool hw_debounce;
+	struct delayed_work debounce_work;
+	bool stamped;
+	u64 timestamp;
+};
+
+/*
+ * The page which can be mapped through /dev/pwm-led. Userspace makes
+ * sequence odd, updates the levels, then makes it even again.
+ */
+struct led_table {
+	u32 sequence;
+	u32 levels[MAX_LED_CHANNELS];
+};
+
+/*
+ * A channel follows the buttons (level) unless it has been requested through
+ * the pwm_chip, in which case it follows the PWM settings of its consumer.
+ */
+struct led_channel {
+	int gpio;
+	struct gpio_desc *desc;
+	int chip;
+	int level;
+	bool pwm;
+	int pwm_saved_level;
+	bool pwm_enabled;
+	bool pwm_inversed;
+	u32 pwm_duty;
+	u32 pwm_period;
+	struct led_classdev cdev;
+	char name[16];
+};
+
+/*
+ * A GPIO controller with LED channels (the channels in mask) and the average
+ * time it takes to write them.
+ */
+struct led_chip {
+	struct gpio_chip *chip;
+	u32 mask;
+	u32 write_cost;
+};
+
+/*
+ * An edge of the output signal: the channels in masks are toggled time
+ * nanoseconds after the start of the period. correction is how much (ns)
+ * time has been moved to make up for the GPIO write cost.
+ */
+struct led_edge {
+	u32 time;
+	u32 masks[NUM_DITHER_KINDS];
+	s32 correction;
+};
+
+/*
+ * One period of the output signal for all channels. The channels in
+ * start_masks go HIGH (and all others LOW) at the start of the period, then
+ * the edges (sorted by time) are applied one after another. dither_frac
+ * holds the share of periods (in 1/DITHER_ONE) in which each channel in
+ * dither_mask gets the extra quantum.
+ */
+struct led_schedule {
+	u32 period;
+	u32 start_masks[NUM_DITHER_KINDS];
+	u32 dither_mask;
+	u32 dither_frac[MAX_LED_CHANNELS];
+	int num_edges;
+	struct led_edge edges[MAX_LED_EDGES];
+};
+
 /*
  * Function prototypes
  */
@@ -48,37 +199,270 @@ setup_pwm_led_gpio(int gpio, const char *target, enum direction direction);
 
 static void unset_pwm_led_gpios(void);
 static int setup_pwm_led_irqs(void);
-static int setup_pwm_led_irq(int gpio, int *irq);
+static int setup_pwm_led_irq(struct led_button *button, int gpio);
+static void unset_pwm_led_irqs(void);
+static void unset_pwm_led_irq(struct led_button *button);
+static void set_button_debounce(struct led_button *button);
+static int set_debounce_time(const char *val, const struct kernel_param *kp);
 static irqreturn_t button_irq_handler(int irq, void *data);
-
-static void led_level_func(struct work_struct *work);
-static void led_ctrl_func(struct work_struct *work);
-
-static void increase_led_brightness(void);
-static void decrease_led_brightness(void);
-static void do_nothing(void) { }
-static void update_led_state(void);
+static irqreturn_t button_irq_thread(int irq, void *data);
+static void schedule_button_unmask(struct led_button *button, u64 deadline);
+static bool button_pressed(struct led_button *button);
+static void button_debounce_func(struct work_struct *work);
+static void apply_button_event(enum event event);
+
+static int setup_pwm_led_engine(void);
+static void stop_pwm_led_engine(void);
+static int setup_pwm_led_chip(void);
+static void unset_pwm_led_chip(void);
+static int pwm_led_chip_request(struct pwm_chip *chip, struct pwm_device *pwm);
+static void pwm_led_chip_free(struct pwm_chip *chip, struct pwm_device *pwm);
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+static int pwm_led_chip_apply(struct pwm_chip *chip, struct pwm_device *pwm,
+			struct pwm_state *state);
+#else
+static int pwm_led_chip_config(struct pwm_chip *chip, struct pwm_device *pwm,
+			int duty_ns, int period_ns);
+static int pwm_led_chip_set_polarity(struct pwm_chip *chip,
+			struct pwm_device *pwm, enum pwm_polarity polarity);
+static int pwm_led_chip_enable(struct pwm_chip *chip, struct pwm_device *pwm);
+static void pwm_led_chip_disable(struct pwm_chip *chip,
+			struct pwm_device *pwm);
+#endif
+static int apply_led_pwm(struct led_channel *channel, u64 period, u64 duty,
+			bool inversed, bool enabled);
+static int setup_pwm_led_classdevs(void);
+static void unset_pwm_led_classdevs(int count);
+static void pwm_led_brightness_set(struct led_classdev *cdev,
+			enum led_brightness brightness);
+static enum led_brightness pwm_led_brightness_get(struct led_classdev *cdev);
+static void led_schedule_func(struct work_struct *work);
+static int setup_pwm_led_stream(void);
+static int pwm_led_stream_open(struct inode *inode, struct file *file);
+static int pwm_led_stream_release(struct inode *inode, struct file *file);
+static ssize_t pwm_led_stream_write(struct file *file, const char __user *buf,
+			size_t count, loff_t *ppos);
+static int push_led_stream_sample(const u32 *sample);
+static bool led_stream_has_room(void);
+static int pwm_led_stream_mmap(struct file *file, struct vm_area_struct *vma);
+static void poll_led_table(void);
+static void led_table_func(struct work_struct *work);
+static int setup_pwm_led_thread(void);
+static void update_button_level(void);
+static enum hrtimer_restart led_ctrl_func(struct hrtimer *timer);
+static int led_ctrl_thread(void *data);
+static u64 led_ctrl_step(void);
+static bool park_led_engine(void);
+static void wake_led_engine(void);
+static void wait_for_led_deadline(void);
+static void measure_timer_latency(void);
+static enum hrtimer_restart calibration_timer_func(struct hrtimer *timer);
+static void measure_thread_latency(void);
+static u64 measure_write_cost(u32 mask);
+static void init_led_chips(void);
+static void calibrate_pwm_led(void);
+static void setup_pwm_led_debugfs(void);
+static int pwm_led_stats_show(struct seq_file *s, void *data);
+static int pwm_led_stats_open(struct inode *inode, struct file *file);
+static void set_led_outputs(u32 outputs);
+static u32 select_led_mask(const u32 *masks);
+static u32 next_led_dither_extra(void);
+static void latch_led_schedule(void);
+static void latch_led_stream(void);
+static void update_led_schedule(void);
+static void build_led_schedule(struct led_schedule *schedule,
+			const int *levels);
+static void build_pwm_schedule(struct led_schedule *schedule,
+			const int *levels);
+static void build_bam_schedule(struct led_schedule *schedule,
+			const int *levels);
+static void add_led_window(struct led_schedule *schedule, u32 mask,
+			u32 start, u32 length, enum dither_kind kind);
+static void add_led_edge(struct led_schedule *schedule, u32 time, u32 mask,
+			enum dither_kind kind);
+static void compensate_write_cost(struct led_schedule *schedule);
+static void move_led_edge(struct led_schedule *schedule,
+			struct led_edge *edge, s32 correction);
+static u32 led_edge_group(u32 mask, const u32 *start_offsets);
+static u32 led_write_run(u32 mask);
+static void led_write_offsets(u32 mask, u32 *offsets);
+static u32 led_high_time(const struct led_channel *channel, int level,
+			u32 period, u32 quantum, u32 *frac);
+static u32 led_pwm_high_time(const struct led_channel *channel, u32 period);
+static u32 clamp_led_pulse(u32 high_time, u32 period);
+static u32 led_phase(int channel, u32 period);
+static u32 led_bam_value(const struct led_channel *channel, int level,
+			u32 period, u32 max_value);
+
+static u64 pwm_led_now(void);
+
+static int increase_led_brightness(int level);
+static int decrease_led_brightness(int level);
+static int do_nothing(int level) { return level; }
+static enum led_state led_state_for_level(int level);
 static void validate_led_max_level(void);
+static int set_pulse_frequency(const char *val, const struct kernel_param *kp);
+static void init_led_channels(void);
 
 /*
  * Data
  */
-static int down_button_irq;
-static int up_button_irq;
+static struct led_button down_button = { .event = DOWN };
+static struct led_button up_button = { .event = UP };
+
+/* Set while the button IRQs are requested */
+static bool led_buttons_ready;
+static DEFINE_MUTEX(led_button_mutex);
+
+static atomic_t led_fsm = ATOMIC_INIT(LED_FSM(OFF, LED_MIN_LEVEL));
+
+static struct led_channel led_channels[MAX_LED_CHANNELS];
+static int num_led_channels;
+
+static struct led_chip led_chips[MAX_LED_CHANNELS];
+static int num_led_chips;
+
+static struct dentry *pwm_led_debugfs;
+
+static struct platform_device *pwm_led_pdev;
+static struct pwm_chip pwm_led_chip;
+
+static const struct pwm_ops pwm_led_ops = {
+	.request = pwm_led_chip_request,
+	.free = pwm_led_chip_free,
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+	.apply = pwm_led_chip_apply,
+#else
+	.config = pwm_led_chip_config,
+	.set_polarity = pwm_led_chip_set_polarity,
+	.enable = pwm_led_chip_enable,
+	.disable = pwm_led_chip_disable,
+#endif
+	.owner = THIS_MODULE,
+};
+
+static const struct file_operations pwm_led_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = pwm_led_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+/* The button level applied to the channels */
+static int led_button_level = LED_MIN_LEVEL;
+static DEFINE_MUTEX(led_button_level_mutex);
+static DECLARE_WORK(led_schedule_work, led_schedule_func);
+
+/*
+ * Schedules are triple-buffered: update_led_schedule() builds into the back
+ * buffer under the mutex and swaps it with the middle one, the engine swaps
+ * the middle buffer with its own at the start of a period if it is marked
+ * as fresh. Neither side ever waits for the other.
+ */
+static struct led_schedule led_schedules[3];
+static atomic_t led_schedule_middle = ATOMIC_INIT(1);
+static int led_schedule_back = 2;
+static DEFINE_MUTEX(led_schedule_mutex);
+
+/* The schedule last published, for debugfs */
+static struct led_schedule *led_published_schedule = &led_schedules[0];
+
+/*
+ * Samples written to /dev/pwm-led, each turned into a schedule right away,
+ * and the number of periods each of them lasts. The slots from tail to head
+ * belong to the engine, the others to pwm_led_stream_write().
+ */
+static struct led_schedule led_stream_schedules[LED_STREAM_DEPTH];
+static u32 led_stream_periods[LED_STREAM_DEPTH];
+static unsigned int led_stream_head;
+static unsigned int led_stream_tail;
+static atomic_t led_stream_state = ATOMIC_INIT(LED_STREAM_IDLE);
+static DECLARE_WAIT_QUEUE_HEAD(led_stream_wait);
+static DEFINE_MUTEX(led_stream_mutex);
+static u32 led_stream_reported_underruns;
+
+/*
+ * The shared brightness table, whether it is mapped and the last sequence
+ * whose levels have been applied.
+ */
+static struct led_table *led_table;
+static bool led_table_mapped;
+static u32 led_table_applied;
+static DECLARE_WORK(led_table_work, led_table_func);
+
+static const struct file_operations pwm_led_stream_fops = {
+	.owner = THIS_MODULE,
+	.open = pwm_led_stream_open,
+	.release = pwm_led_stream_release,
+	.write = pwm_led_stream_write,
+	.mmap = pwm_led_stream_mmap,
+	.llseek = no_llseek,
+};
+
+static struct miscdevice pwm_led_miscdev = {
+	.minor = MISC_DYNAMIC_MINOR,
+	.name = "pwm-led",
+	.fops = &pwm_led_stream_fops,
+};
 
-static struct timespec64 prev_down_button_irq;
-static struct timespec64 prev_up_button_irq;
-static struct timespec64 prev_led_switch;
+/* Set once the engine can take schedules */
+static bool led_engine_ready;
 
-static atomic_t led_level = ATOMIC_INIT(LED_MIN_LEVEL);
+/* The LEDs are driven either by the timer or by the thread */
+static struct hrtimer led_timer;
+static struct task_struct *led_thread;
+
+/* Set while all LEDs are fully off or fully on and the engine is idle */
+static atomic_t led_engine_parked = ATOMIC_INIT(1);
+
+/*
+ * Owned by the engine: the schedule of the current period, its start time
+ * (CLOCK_MONOTONIC, ns), the index of the next edge and the values last
+ * written to the LED GPIOs (bit i for channel i).
+ */
+static int led_schedule_front;
+static struct led_schedule *led_schedule = &led_schedules[0];
+static u64 led_period_start;
+static int led_next_edge = LED_PERIOD_START;
+static u32 led_outputs;
 
-static enum led_state led_state = OFF;
-static enum event led_event = NONE;
+/*
+ * Owned by the engine: the stream sample being played (in the slot at
+ * led_stream_tail), how many more periods it lasts and the number of periods
+ * in which no new sample was available.
+ */
+static struct led_schedule *led_stream_sample;
+static u32 led_stream_hold;
+static u32 led_stream_underruns;
 
-static DECLARE_WORK(led_level_work, led_level_func);
-static DECLARE_WORK(led_switch_work, led_ctrl_func);
+/*
+ * Owned by the engine: the sigma-delta accumulators of dithered channels and
+ * the channels which get the extra quantum in the current period.
+ */
+static u32 led_dither_acc[MAX_LED_CHANNELS];
+static u32 led_dither_extra;
 
-static void (*fsm_functions[NUM_STATES][NUM_EVENTS])(void) = {
+/*
+ * Owned by the engine: how early (ns) it wakes up before each deadline to
+ * busy-wait for it, and the deadline of the next step.
+ */
+static u64 led_margin;
+static u64 led_deadline;
+
+/* Used to measure the wake-up latency of the engine at load time */
+static struct hrtimer calibration_timer;
+static DECLARE_COMPLETION(calibration_done);
+static u64 calibration_deadline;
+static u64 calibration_min_latency;
+static u64 calibration_max_latency;
+static int calibration_samples;
+
+/* Scratch arrays for writing all GPIOs of an edge with a single call */
+static struct gpio_desc *led_edge_descs[MAX_LED_CHANNELS];
+static int led_edge_values[MAX_LED_CHANNELS];
+
+static int (*fsm_functions[NUM_STATES][NUM_EVENTS])(int level) = {
 	{ do_nothing, increase_led_brightness, do_nothing },
 	{ do_nothing, increase_led_brightness, decrease_led_brightness },
 	{ do_nothing, do_nothing, decrease_led_brightness }
@@ -97,13 +481,42 @@ module_param(up_button_gpio, int, S_IRUGO);
 MODULE_PARM_DESC(up_button_gpio,
 		"The GPIO where the up button is connected (default = 24).");
 
+static const struct kernel_param_ops debounce_time_ops = {
+	.set = set_debounce_time,
+	.get = param_get_uint,
+};
+
+static unsigned int debounce_time = BUTTON_DEBOUNCE_DEFAULT;
+module_param_cb(debounce_time, &debounce_time_ops, &debounce_time,
+		S_IRUGO | S_IWUSR);
+MODULE_PARM_DESC(debounce_time,
+		"Debounce time of the buttons in nanoseconds (default = 200 000 000).");
+
 static int led_gpio = LED_GPIO;
 module_param(led_gpio, int, S_IRUGO);
 MODULE_PARM_DESC(led_gpio,
 		"The GPIO where the LED is connected (default = 18).");
 
+static int led_gpios[MAX_LED_CHANNELS];
+static unsigned int num_led_gpios;
+module_param_array(led_gpios, int, &num_led_gpios, S_IRUGO);
+MODULE_PARM_DESC(led_gpios,
+		"The GPIOs of multiple LED channels (default = led_gpio).");
+
+static int led_levels[MAX_LED_CHANNELS];
+static unsigned int num_led_levels;
+module_param_array(led_levels, int, &num_led_levels, S_IRUGO);
+MODULE_PARM_DESC(led_levels,
+		"Initial brightness levels of the LED channels (default = 0).");
+
+static const struct kernel_param_ops pulse_frequency_ops = {
+	.set = set_pulse_frequency,
+	.get = param_get_int,
+};
+
 static int pulse_frequency = PULSE_FREQUENCY_DEFAULT;
-module_param(pulse_frequency, int, S_IRUGO);
+module_param_cb(pulse_frequency, &pulse_frequency_ops, &pulse_frequency,
+		S_IRUGO | S_IWUSR);
 MODULE_PARM_DESC(pulse_frequency,
 		"Frequency in nanoseconds of PWM (default = 100 000).");
 
@@ -112,11 +525,63 @@ module_param(led_max_level, int, S_IRUGO);
 MODULE_PARM_DESC(led_max_level,
 		"Maximum brightness level of the LED (default = 5).");
 
+static unsigned int led_phases[MAX_LED_CHANNELS];
+static unsigned int num_led_phases;
+module_param_array(led_phases, uint, &num_led_phases, S_IRUGO);
+MODULE_PARM_DESC(led_phases,
+		"Phase offsets in nanoseconds of the LED channels (default = 0).");
+
+static bool auto_phase;
+module_param(auto_phase, bool, S_IRUGO);
+MODULE_PARM_DESC(auto_phase,
+		"Spread the channels evenly across the period (default = false).");
+
+static bool pwm_thread;
+module_param(pwm_thread, bool, S_IRUGO);
+MODULE_PARM_DESC(pwm_thread,
+		"Drive the LEDs from a SCHED_FIFO kernel thread (default = false).");
+
+static int pwm_thread_cpu = -1;
+module_param(pwm_thread_cpu, int, S_IRUGO);
+MODULE_PARM_DESC(pwm_thread_cpu,
+		"The CPU the PWM thread is bound to (default = -1, any CPU).");
+
+static bool precise_edges;
+module_param(precise_edges, bool, S_IRUGO);
+MODULE_PARM_DESC(precise_edges,
+		"Wake up early and busy-wait until each edge is due (default = false).");
+
+static unsigned int precision_margin;
+module_param(precision_margin, uint, S_IRUGO);
+MODULE_PARM_DESC(precision_margin,
+		"How early in nanoseconds to wake up for precise edges (default = 0, calibrated).");
+
+static unsigned int min_pulse;
+module_param(min_pulse, uint, S_IRUGO);
+MODULE_PARM_DESC(min_pulse,
+		"Shortest HIGH or LOW time in nanoseconds (default = 0, calibrated).");
+
+static bool dither;
+module_param(dither, bool, S_IRUGO);
+MODULE_PARM_DESC(dither,
+		"Dither the HIGH time across consecutive periods (default = false).");
+
+static unsigned int dither_quantum = DITHER_QUANTUM_DEFAULT;
+module_param(dither_quantum, uint, S_IRUGO);
+MODULE_PARM_DESC(dither_quantum,
+		"Smallest step in nanoseconds of the HIGH time when dithering (default = 1000).");
+
+static bool bam_mode;
+module_param(bam_mode, bool, S_IRUGO);
+MODULE_PARM_DESC(bam_mode,
+		"Use bit-angle modulation instead of PWM (default = false).");
+
 static int __init pwm_led_init(void)
 {
 	int ret;
 
 	validate_led_max_level();
+	init_led_channels();
 
 	ret = setup_pwm_led_gpios();
 	if (ret)
@@ -126,15 +591,37 @@ static int __init pwm_led_init(void)
 	if (ret)
 		goto irq_err;
 
-	getnstimeofday64(&prev_down_button_irq);
-	getnstimeofday64(&prev_up_button_irq);
-	getnstimeofday64(&prev_led_switch);
+	ret = setup_pwm_led_engine();
+	if (ret)
+		goto engine_err;
+
+	ret = setup_pwm_led_chip();
+	if (ret)
+		goto chip_err;
+
+	ret = setup_pwm_led_classdevs();
+	if (ret)
+		goto classdev_err;
+
+	ret = setup_pwm_led_stream();
+	if (ret)
+		goto stream_err;
+
+	setup_pwm_led_debugfs();
 
-	schedule_work(&led_switch_work);
 	pr_info("%s: PWM LED module loaded\n", MODULE_NAME);
 
 	goto out;
 
+stream_err:
+	unset_pwm_led_classdevs(num_led_channels);
+classdev_err:
+	cancel_work_sync(&led_schedule_work);
+	unset_pwm_led_chip();
+chip_err:
+	stop_pwm_led_engine();
+engine_err:
+	unset_pwm_led_irqs();
 irq_err:
 	unset_pwm_led_gpios();
 out:
@@ -143,26 +630,107 @@ out:
 
 static void __exit pwm_led_exit(void)
 {
-	cancel_work_sync(&led_level_work);
-	cancel_work_sync(&led_switch_work);
+	debugfs_remove_recursive(pwm_led_debugfs);
 
-	free_irq(down_button_irq, NULL);
-	free_irq(up_button_irq, NULL);
+	misc_deregister(&pwm_led_miscdev);
+	cancel_work_sync(&led_table_work);
+	free_page((unsigned long)led_table);
+	unset_pwm_led_classdevs(num_led_channels);
+	cancel_work_sync(&led_schedule_work);
+	unset_pwm_led_chip();
+	stop_pwm_led_engine();
+
+	unset_pwm_led_irqs();
 
 	unset_pwm_led_gpios();
 
 	pr_info("%s: PWM LED module unloaded\n", MODULE_NAME);
 }
 
+/*
+ * The level has to fit into the FSM word next to the state, and there have
+ * to be at least two levels, off and on.
+ */
 static void validate_led_max_level(void)
 {
-       if (led_max_level < LED_MIN_LEVEL)
-               led_max_level = LED_MIN_LEVEL;
+	BUILD_BUG_ON(NUM_STATES > 1 << LED_FSM_STATE_BITS);
+
+	if (led_max_level < LED_MIN_LEVEL + 1)
+		led_max_level = LED_MIN_LEVEL + 1;
+	if (led_max_level > LED_MAX_LEVEL_LIMIT)
+		led_max_level = LED_MAX_LEVEL_LIMIT;
+}
+
+/*
+ * pulse_frequency can be changed at runtime. The new period takes effect
+ * together with the matching edges at the start of the next period. While a
+ * PWM consumer has an enabled channel the period belongs to it. A value which
+ * is not positive falls back to the default at load time only.
+ */
+static int set_pulse_frequency(const char *val, const struct kernel_param *kp)
+{
+	int frequency, ret, i;
+
+	ret = kstrtoint(val, 0, &frequency);
+	if (ret)
+		return ret;
+
+	mutex_lock(&led_schedule_mutex);
+
+	if (!led_engine_ready) {
+		if (frequency <= 0)
+			frequency = PULSE_FREQUENCY_DEFAULT;
+		pulse_frequency = frequency;
+		mutex_unlock(&led_schedule_mutex);
+		return 0;
+	}
+
+	if (frequency <= 0 || (unsigned int)frequency < min_pulse) {
+		mutex_unlock(&led_schedule_mutex);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < num_led_channels; i++) {
+		if (led_channels[i].pwm && led_channels[i].pwm_enabled) {
+			mutex_unlock(&led_schedule_mutex);
+			return -EBUSY;
+		}
+	}
+
+	WRITE_ONCE(pulse_frequency, frequency);
+	mutex_unlock(&led_schedule_mutex);
+
+	update_led_schedule();
+
+	return 0;
+}
+
+/*
+ * Without led_gpios the module drives a single LED connected to led_gpio.
+ */
+static void init_led_channels(void)
+{
+	int i;
+
+	if (!num_led_gpios) {
+		led_gpios[0] = led_gpio;
+		num_led_gpios = 1;
+	}
+
+	num_led_channels = num_led_gpios;
+	for (i = 0; i < num_led_channels; i++) {
+		led_channels[i].gpio = led_gpios[i];
+		led_channels[i].level = LED_MIN_LEVEL;
+		if (i < num_led_levels)
+			led_channels[i].level = clamp(led_levels[i],
+							LED_MIN_LEVEL,
+							led_max_level);
+	}
 }
 
 static int setup_pwm_led_gpios(void)
 {
-	int ret;
+	int ret, i;
 
 	ret = setup_pwm_led_gpio(down_button_gpio, "down button", INPUT);
 	if (ret)
@@ -170,12 +738,24 @@ static int setup_pwm_led_gpios(void)
 
 	ret = setup_pwm_led_gpio(up_button_gpio, "up button", INPUT);
 	if (ret)
-		return ret;
+		goto up_button_err;
 
-	ret = setup_pwm_led_gpio(led_gpio, "led", OUTPUT);
-	if (ret)
-		return ret;
+	for (i = 0; i < num_led_channels; i++) {
+		ret = setup_pwm_led_gpio(led_channels[i].gpio, "led", OUTPUT);
+		if (ret)
+			goto led_err;
 
+		led_channels[i].desc = gpio_to_desc(led_channels[i].gpio);
+	}
+
+	return ret;
+
+led_err:
+	while (i--)
+		gpio_free(led_channels[i].gpio);
+	gpio_free(up_button_gpio);
+up_button_err:
+	gpio_free(down_button_gpio);
 	return ret;
 }
 
@@ -216,54 +796,68 @@ setup_pwm_led_gpio(int gpio, const char *target, enum direction direction)
 
 static void unset_pwm_led_gpios(void)
 {
+	int i;
+
 	gpio_free(down_button_gpio);
 	gpio_free(up_button_gpio);
-	gpio_free(led_gpio);
+
+	for (i = 0; i < num_led_channels; i++)
+		gpio_free(led_channels[i].gpio);
 }
 
 static int setup_pwm_led_irqs(void)
 {
 	int ret;
 
-	ret = setup_pwm_led_irq(down_button_gpio, &down_button_irq);
+	ret = setup_pwm_led_irq(&down_button, down_button_gpio);
 	if (ret)
 		return ret;
 
-	ret = setup_pwm_led_irq(up_button_gpio, &up_button_irq);
+	ret = setup_pwm_led_irq(&up_button, up_button_gpio);
 	if (ret) {
-		free_irq(down_button_irq, NULL);
+		unset_pwm_led_irq(&down_button);
 		return ret;
 	}
 
+	mutex_lock(&led_button_mutex);
+	led_buttons_ready = true;
+	mutex_unlock(&led_button_mutex);
+
 	return ret;
 }
 
-static int setup_pwm_led_irq(int gpio, int *irq)
+static int setup_pwm_led_irq(struct led_button *button, int gpio)
 {
 	int ret;
 
 	ret = 0;
-	*irq = gpio_to_irq(gpio);
-	if (*irq < 0) {
+	button->gpio = gpio;
+	button->irq = gpio_to_irq(gpio);
+	if (button->irq < 0) {
 		pr_err("%s: %s (%d): Failed to obtain IRQ for GPIO %d\n",
 			MODULE_NAME,
 			__func__,
 			__LINE__,
 			gpio);
-		return *irq;
+		return button->irq;
 	}
 
-	ret = request_irq(*irq,
+	INIT_DELAYED_WORK(&button->debounce_work, button_debounce_func);
+
+	set_button_debounce(button);
+
+	ret = request_threaded_irq(button->irq,
 			button_irq_handler,
-			IRQF_TRIGGER_RISING,
+			button_irq_thread,
+			IRQF_TRIGGER_RISING | IRQF_ONESHOT,
 			"pwm-led-btn-handler",
-			NULL);
+			button);
 	if (ret < 0) {
 		pr_err("%s: %s (%d): Request IRQ failed for IRQ %d\n",
 			MODULE_NAME,
 			__func__,
 			__LINE__,
-			*irq);
+			button->irq);
 
 		return ret;
 	}
@@ -271,109 +865,1872 @@ static int setup_pwm_led_irq(int gpio, int *irq)
 	return ret;
 }
 
-static irqreturn_t button_irq_handler(int irq, void *data)
+static void unset_pwm_led_irqs(void)
 {
-	struct timespec64 now, interval;
-	long millis_since_last_irq;
+	mutex_lock(&led_button_mutex);
+	led_buttons_ready = false;
+	mutex_unlock(&led_button_mutex);
 
-	getnstimeofday64(&now);
+	unset_pwm_led_irq(&down_button);
+	unset_pwm_led_irq(&up_button);
+}
 
-	if (irq == down_button_irq) {
-		interval = timespec64_sub(now, prev_down_button_irq);
-		millis_since_last_irq = ((long)interval.tv_sec * MSEC_PER_SEC) +
-					(interval.tv_nsec / NSEC_PER_MSEC);
+/*
+ * disable_irq() waits for a running handler thread, so no new debounce work
+ * can be queued once it returns and the pending one can be cancelled before
+ * the IRQ is freed. The IRQ is unmasked again when it is next requested.
+ */
+static void unset_pwm_led_irq(struct led_button *button)
+{
+	disable_irq(button->irq);
+	cancel_delayed_work_sync(&button->debounce_work);
+	free_irq(button->irq, button);
+}
 
-		if (millis_since_last_irq < BUTTON_DEBOUNCE)
-			return IRQ_HANDLED;
+/*
+ * Lets the GPIO controller debounce the button if it can, so that bounces
+ * do not even raise an interrupt. Otherwise the IRQ handler masks the IRQ
+ * for the debounce time.
+ */
+static void set_button_debounce(struct led_button *button)
+{
+	unsigned int debounce;
+	int ret;
 
-		prev_down_button_irq = now;
-		led_event = DOWN;
-	} else if (irq == up_button_irq) {
-		interval = timespec64_sub(now, prev_up_button_irq);
-		millis_since_last_irq = ((long)interval.tv_sec * MSEC_PER_SEC) +
-					(interval.tv_nsec / NSEC_PER_MSEC);
+	debounce = DIV_ROUND_UP(READ_ONCE(debounce_time), NSEC_PER_USEC);
+	ret = gpiod_set_debounce(gpio_to_desc(button->gpio), debounce);
+	WRITE_ONCE(button->hw_debounce, !ret);
+}
 
-		if (millis_since_last_irq < BUTTON_DEBOUNCE)
-			return IRQ_HANDLED;
+/*
+ * debounce_time can be changed at runtime. Masked IRQs are unmasked after
+ * the time they were masked for.
+ */
+static int set_debounce_time(const char *val, const struct kernel_param *kp)
+{
+	int ret;
 
-		prev_up_button_irq = now;
-		led_event = UP;
+	ret = param_set_uint(val, kp);
+	if (ret)
+		return ret;
+
+	mutex_lock(&led_button_mutex);
+	if (led_buttons_ready) {
+		set_button_debounce(&down_button);
+		set_button_debounce(&up_button);
 	}
+	mutex_unlock(&led_button_mutex);
 
-	schedule_work(&led_level_work);
-	return IRQ_HANDLED;
+	return 0;
 }
 
-static void led_level_func(struct work_struct *work)
+/*
+ * Unless a thread is used, the LEDs are toggled from the hrtimer callback,
+ * i.e. in hard-IRQ context, so the GPIO controllers must not need to sleep
+ * when a value is set.
+ */
+static int setup_pwm_led_engine(void)
 {
-	int level, led_brightness_percent;
+	int ret, i;
 
-	fsm_functions[led_state][led_event]();
-	update_led_state();
+	if (pwm_thread) {
+		ret = setup_pwm_led_thread();
+		if (ret)
+			return ret;
+	} else {
+		for (i = 0; i < num_led_channels; i++) {
+			if (!gpiod_cansleep(led_channels[i].desc))
+				continue;
+
+			pr_err("%s: %s (%d): GPIO %d cannot be set from atomic context\n",
+				MODULE_NAME,
+				__func__,
+				__LINE__,
+				led_channels[i].gpio);
+			return -EINVAL;
+		}
+
+		measure_timer_latency();
+
+		hrtimer_init(&led_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+		led_timer.function = led_ctrl_func;
+	}
 
-	level = atomic_read(&led_level);
-	led_brightness_percent = 100 * level / led_max_level;
+	calibrate_pwm_led();
 
-	pr_info("%s: LED brightness %d%% (level %d)\n",
-		MODULE_NAME,
-		led_brightness_percent,
-		level);
+	mutex_lock(&led_schedule_mutex);
+	led_engine_ready = true;
+	mutex_unlock(&led_schedule_mutex);
+
+	/* Starts the engine unless all channels are initially static */
+	update_led_schedule();
+
+	return 0;
 }
 
-static void update_led_state(void)
+static void stop_pwm_led_engine(void)
 {
-	int level;
+	mutex_lock(&led_schedule_mutex);
+	led_engine_ready = false;
+	mutex_unlock(&led_schedule_mutex);
+
+	if (led_thread)
+		kthread_stop(led_thread);
+	else
+		hrtimer_cancel(&led_timer);
+}
 
-	level = atomic_read(&led_level);
-	if (level == LED_MIN_LEVEL) {
-		led_state = OFF;
-	} else if (level == led_max_level) {
-		led_state = MAX;
-	} else {
-		led_state = ON;
+/*
+ * Registers the LED channels as a PWM controller, so that any PWM consumer
+ * (pwm-leds, pwm-fan, /sys/class/pwm, ...) can use them. As there is no
+ * device tree node, the chip is attached to a platform device of its own.
+ */
+static int setup_pwm_led_chip(void)
+{
+	int ret;
+
+	pwm_led_pdev = platform_device_register_simple("pwm-led", -1, NULL, 0);
+	if (IS_ERR(pwm_led_pdev)) {
+		pr_err("%s: %s (%d): Failed to register the platform device\n",
+			MODULE_NAME,
+			__func__,
+			__LINE__);
+		return PTR_ERR(pwm_led_pdev);
+	}
+
+	pwm_led_chip.dev = &pwm_led_pdev->dev;
+	pwm_led_chip.ops = &pwm_led_ops;
+	pwm_led_chip.base = -1;
+	pwm_led_chip.npwm = num_led_channels;
+#if LINUX_VERSION_CODE < KERNEL_VERSION(4, 7, 0)
+	pwm_led_chip.can_sleep = true;
+#endif
+
+	ret = pwmchip_add(&pwm_led_chip);
+	if (ret) {
+		pr_err("%s: %s (%d): Failed to register the PWM chip\n",
+			MODULE_NAME,
+			__func__,
+			__LINE__);
+		platform_device_unregister(pwm_led_pdev);
+		return ret;
 	}
+
+	return 0;
 }
 
-static void increase_led_brightness(void)
+static void unset_pwm_led_chip(void)
 {
-	atomic_inc(&led_level);
+	pwmchip_remove(&pwm_led_chip);
+	platform_device_unregister(pwm_led_pdev);
 }
 
-static void decrease_led_brightness(void)
+/*
+ * A requested channel is taken away from the buttons and stays LOW until its
+ * consumer enables it. Once freed, it returns to the level it had when it
+ * was requested.
+ */
+static int pwm_led_chip_request(struct pwm_chip *chip, struct pwm_device *pwm)
 {
-	atomic_dec(&led_level);
+	struct led_channel *channel = &led_channels[pwm->hwpwm];
+
+	mutex_lock(&led_schedule_mutex);
+	WRITE_ONCE(channel->pwm, true);
+	channel->pwm_saved_level = channel->level;
+	channel->pwm_enabled = false;
+	channel->pwm_inversed = false;
+	channel->pwm_duty = 0;
+	channel->pwm_period = pulse_frequency;
+	mutex_unlock(&led_schedule_mutex);
+
+	update_led_schedule();
+
+	return 0;
 }
 
-static void led_ctrl_func(struct work_struct *work)
+static void pwm_led_chip_free(struct pwm_chip *chip, struct pwm_device *pwm)
 {
-	int required_delay, nanos_since_led_switch, led_gpio_value, level;
-	struct timespec64 now, diff;
+	struct led_channel *channel = &led_channels[pwm->hwpwm];
 
-	getnstimeofday64(&now);
-	diff = timespec64_sub(now, prev_led_switch);
-	nanos_since_led_switch = (diff.tv_sec * USEC_PER_SEC) + diff.tv_nsec;
+	mutex_lock(&led_schedule_mutex);
+	WRITE_ONCE(channel->pwm, false);
+	channel->pwm_enabled = false;
+	WRITE_ONCE(channel->level, channel->pwm_saved_level);
+	mutex_unlock(&led_schedule_mutex);
 
-	level = atomic_read(&led_level);
-	if (level == LED_MIN_LEVEL || level == led_max_level) {
-		gpio_set_value(led_gpio, level == LED_MIN_LEVEL ? LOW : HIGH);
-		schedule_work(work);
-		return;
+	update_led_schedule();
+}
+
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 7, 0)
+static int pwm_led_chip_apply(struct pwm_chip *chip, struct pwm_device *pwm,
+			struct pwm_state *state)
+{
+	return apply_led_pwm(&led_channels[pwm->hwpwm],
+				state->period,
+				state->duty_cycle,
+				state->polarity == PWM_POLARITY_INVERSED,
+				state->enabled);
+}
+#else
+static int pwm_led_chip_config(struct pwm_chip *chip, struct pwm_device *pwm,
+			int duty_ns, int period_ns)
+{
+	struct led_channel *channel = &led_channels[pwm->hwpwm];
+
+	return apply_led_pwm(channel, period_ns, duty_ns,
+				channel->pwm_inversed, channel->pwm_enabled);
+}
+
+static int pwm_led_chip_set_polarity(struct pwm_chip *chip,
+			struct pwm_device *pwm, enum pwm_polarity polarity)
+{
+	struct led_channel *channel = &led_channels[pwm->hwpwm];
+
+	return apply_led_pwm(channel, channel->pwm_period, channel->pwm_duty,
+				polarity == PWM_POLARITY_INVERSED,
+				channel->pwm_enabled);
+}
+
+static int pwm_led_chip_enable(struct pwm_chip *chip, struct pwm_device *pwm)
+{
+	struct led_channel *channel = &led_channels[pwm->hwpwm];
+
+	return apply_led_pwm(channel, channel->pwm_period, channel->pwm_duty,
+				channel->pwm_inversed, true);
+}
+
+static void pwm_led_chip_disable(struct pwm_chip *chip,
+			struct pwm_device *pwm)
+{
+	struct led_channel *channel = &led_channels[pwm->hwpwm];
+
+	apply_led_pwm(channel, channel->pwm_period, channel->pwm_duty,
+			channel->pwm_inversed, false);
+}
+#endif
+
+/*
+ * All channels share the period of the engine, as with hardware PWM
+ * controllers with a single time base: a consumer may only change it while
+ * no other channel is enabled through the pwm_chip. The new settings take
+ * effect at the start of the next period. Disabling a channel never fails:
+ * settings which could not be enabled are dropped and the previous ones kept.
+ */
+static int apply_led_pwm(struct led_channel *channel, u64 period, u64 duty,
+			bool inversed, bool enabled)
+{
+	int i;
+
+	if (!enabled) {
+		mutex_lock(&led_schedule_mutex);
+		if (period && period <= INT_MAX && duty <= period) {
+			channel->pwm_period = period;
+			channel->pwm_duty = duty;
+		}
+		channel->pwm_inversed = inversed;
+		channel->pwm_enabled = false;
+		mutex_unlock(&led_schedule_mutex);
+
+		update_led_schedule();
+
+		return 0;
 	}
 
-	led_gpio_value = gpio_get_value(led_gpio);
-	if (led_gpio_value == LOW) {
-		required_delay = pulse_frequency -
-				(pulse_frequency * level / led_max_level);
-	} else {
-		required_delay = pulse_frequency * level / led_max_level;
+	if (!period || period > INT_MAX || period < min_pulse || duty > period)
+		return -EINVAL;
+
+	mutex_lock(&led_schedule_mutex);
+
+	if (period != pulse_frequency) {
+		for (i = 0; i < num_led_channels; i++) {
+			if (&led_channels[i] == channel ||
+			    !led_channels[i].pwm ||
+			    !led_channels[i].pwm_enabled)
+				continue;
+
+			mutex_unlock(&led_schedule_mutex);
+			return -EBUSY;
+		}
+
+		WRITE_ONCE(pulse_frequency, period);
 	}
 
-	if (nanos_since_led_switch >= required_delay) {
-		gpio_set_value(led_gpio, !led_gpio_value);
-		prev_led_switch = now;
+	channel->pwm_period = period;
+	channel->pwm_duty = duty;
+	channel->pwm_inversed = inversed;
+	channel->pwm_enabled = enabled;
+
+	mutex_unlock(&led_schedule_mutex);
+
+	update_led_schedule();
+
+	return 0;
+}
+
+/*
+ * Registers a LED class device per channel, so the channels can be controlled
+ * through /sys/class/leds and by LED triggers. The brightness range is the
+ * level range.
+ */
+static int setup_pwm_led_classdevs(void)
+{
+	struct led_channel *channel;
+	int ret, i;
+
+	for (i = 0; i < num_led_channels; i++) {
+		channel = &led_channels[i];
+		snprintf(channel->name, sizeof(channel->name), "pwm-led:%d", i);
+
+		channel->cdev.name = channel->name;
+		channel->cdev.brightness = channel->level;
+		channel->cdev.max_brightness = led_max_level;
+		channel->cdev.brightness_set = pwm_led_brightness_set;
+		channel->cdev.brightness_get = pwm_led_brightness_get;
+
+		ret = led_classdev_register(&pwm_led_pdev->dev, &channel->cdev);
+		if (ret) {
+			pr_err("%s: %s (%d): Failed to register LED %s\n",
+				MODULE_NAME,
+				__func__,
+				__LINE__,
+				channel->name);
+			unset_pwm_led_classdevs(i);
+			return ret;
+		}
 	}
 
-	schedule_work(work);
+	return 0;
+}
+
+static void unset_pwm_led_classdevs(int count)
+{
+	int i;
+
+	for (i = 0; i < count; i++)
+		led_classdev_unregister(&led_channels[i].cdev);
+}
+
+/*
+ * May be called from atomic context (e.g. by triggers), so it only publishes
+ * the new level and leaves the schedule to be rebuilt by a work. Updates
+ * which arrive before the work runs are coalesced into one rebuild. Writes to
+ * channels requested through the pwm_chip are ignored.
+ */
+static void pwm_led_brightness_set(struct led_classdev *cdev,
+			enum led_brightness brightness)
+{
+	struct led_channel *channel;
+
+	channel = container_of(cdev, struct led_channel, cdev);
+	if (READ_ONCE(channel->pwm))
+		return;
+
+	WRITE_ONCE(channel->level, brightness);
+	schedule_work(&led_schedule_work);
+}
+
+static enum led_brightness pwm_led_brightness_get(struct led_classdev *cdev)
+{
+	struct led_channel *channel;
+
+	channel = container_of(cdev, struct led_channel, cdev);
+	return READ_ONCE(channel->level);
+}
+
+static void led_schedule_func(struct work_struct *work)
+{
+	update_led_schedule();
+}
+
+/*
+ * /dev/pwm-led streams brightness samples to the engine. A sample is one u32
+ * with the number of periods it lasts followed by one u32 level per channel.
+ */
+static int setup_pwm_led_stream(void)
+{
+	int ret;
+
+	led_table = (struct led_table *)get_zeroed_page(GFP_KERNEL);
+	if (!led_table)
+		return -ENOMEM;
+
+	ret = misc_register(&pwm_led_miscdev);
+	if (ret) {
+		pr_err("%s: %s (%d): Failed to register /dev/%s\n",
+			MODULE_NAME,
+			__func__,
+			__LINE__,
+			pwm_led_miscdev.name);
+		free_page((unsigned long)led_table);
+	}
+
+	return ret;
+}
+
+static int pwm_led_stream_open(struct inode *inode, struct file *file)
+{
+	if (atomic_cmpxchg(&led_stream_state, LED_STREAM_IDLE,
+			LED_STREAM_OPEN) != LED_STREAM_IDLE)
+		return -EBUSY;
+
+	led_stream_reported_underruns = READ_ONCE(led_stream_underruns);
+
+	return nonseekable_open(inode, file);
+}
+
+/*
+ * Unless no sample has been written, the engine drops the remaining samples
+ * at its next period start and returns to the levels of the channels.
+ */
+static int pwm_led_stream_release(struct inode *inode, struct file *file)
+{
+	WRITE_ONCE(led_table_mapped, false);
+
+	if (atomic_cmpxchg(&led_stream_state, LED_STREAM_OPEN,
+			LED_STREAM_IDLE) == LED_STREAM_OPEN)
+		return 0;
+
+	atomic_set(&led_stream_state, LED_STREAM_CLOSING);
+	wake_led_engine();
+
+	return 0;
+}
+
+/*
+ * Queues whole samples and blocks (unless O_NONBLOCK) while the ring is
+ * full. Like an audio stream, the first write after the engine has run out
+ * of samples fails with -EPIPE, so the writer learns that it has fallen
+ * behind; the engine keeps playing the last sample meanwhile.
+ */
+static ssize_t pwm_led_stream_write(struct file *file, const char __user *buf,
+			size_t count, loff_t *ppos)
+{
+	u32 sample[1 + MAX_LED_CHANNELS];
+	size_t size, done;
+	u32 underruns;
+	ssize_t ret = 0;
+
+	size = (1 + num_led_channels) * sizeof(u32);
+	if (count % size)
+		return -EINVAL;
+
+	mutex_lock(&led_stream_mutex);
+
+	underruns = READ_ONCE(led_stream_underruns);
+	if (underruns != led_stream_reported_underruns) {
+		led_stream_reported_underruns = underruns;
+		ret = -EPIPE;
+		goto out;
+	}
+
+	for (done = 0; done < count; done += size) {
+		if (!led_stream_has_room()) {
+			if (done)
+				break;
+
+			if (file->f_flags & O_NONBLOCK) {
+				ret = -EAGAIN;
+				goto out;
+			}
+
+			ret = wait_event_interruptible(led_stream_wait,
+						led_stream_has_room());
+			if (ret)
+				goto out;
+		}
+
+		if (copy_from_user(sample, buf + done, size)) {
+			ret = done ? 0 : -EFAULT;
+			break;
+		}
+
+		ret = push_led_stream_sample(sample);
+		if (ret)
+			break;
+	}
+
+	if (done) {
+		atomic_cmpxchg(&led_stream_state, LED_STREAM_OPEN,
+				LED_STREAM_ACTIVE);
+		wake_led_engine();
+		ret = done;
+	}
+
+out:
+	mutex_unlock(&led_stream_mutex);
+
+	return ret;
+}
+
+static bool led_stream_has_room(void)
+{
+	return led_stream_head - smp_load_acquire(&led_stream_tail) <
+		LED_STREAM_DEPTH;
+}
+
+/*
+ * Maps the brightness table, which starts out with the current levels. While
+ * it is mapped, the engine checks its sequence at every period start, even if
+ * all channels are static.
+ */
+static int pwm_led_stream_mmap(struct file *file, struct vm_area_struct *vma)
+{
+	int ret, i;
+
+	if (vma->vm_pgoff || vma->vm_end - vma->vm_start > PAGE_SIZE)
+		return -EINVAL;
+
+	if (!READ_ONCE(led_table_mapped)) {
+		for (i = 0; i < num_led_channels; i++)
+			led_table->levels[i] = READ_ONCE(led_channels[i].level);
+		led_table_applied = led_table->sequence;
+	}
+
+	ret = remap_pfn_range(vma, vma->vm_start,
+				virt_to_phys(led_table) >> PAGE_SHIFT,
+				vma->vm_end - vma->vm_start,
+				vma->vm_page_prot);
+	if (ret)
+		return ret;
+
+	WRITE_ONCE(led_table_mapped, true);
+	wake_led_engine();
+
+	return 0;
+}
+
+/*
+ * Called at every period start: a single load tells whether the table has
+ * changed since its levels were last applied. Rebuilding the schedule is
+ * left to a work, so the new levels take effect a period or so later.
+ */
+static void poll_led_table(void)
+{
+	u32 sequence;
+
+	if (!READ_ONCE(led_table_mapped))
+		return;
+
+	sequence = READ_ONCE(led_table->sequence);
+	if (sequence & 1 || sequence == READ_ONCE(led_table_applied))
+		return;
+
+	schedule_work(&led_table_work);
+}
+
+/*
+ * Applies a consistent snapshot of the table to the channels. If userspace
+ * is updating it meanwhile, the next period start tries again.
+ */
+static void led_table_func(struct work_struct *work)
+{
+	u32 levels[MAX_LED_CHANNELS];
+	u32 sequence;
+	int i;
+
+	sequence = READ_ONCE(led_table->sequence);
+	smp_rmb();
+	for (i = 0; i < num_led_channels; i++)
+		levels[i] = READ_ONCE(led_table->levels[i]);
+	smp_rmb();
+	if (sequence & 1 || sequence != READ_ONCE(led_table->sequence))
+		return;
+
+	for (i = 0; i < num_led_channels; i++)
+		WRITE_ONCE(led_channels[i].level,
+				min_t(u32, levels[i], led_max_level));
+
+	update_led_schedule();
+	WRITE_ONCE(led_table_applied, sequence);
+}
+
+/*
+ * Turns a sample into a schedule in the next free slot and hands it over to
+ * the engine.
+ */
+static int push_led_stream_sample(const u32 *sample)
+{
+	int levels[MAX_LED_CHANNELS];
+	unsigned int slot;
+	int i;
+
+	for (i = 0; i < num_led_channels; i++)
+		levels[i] = min_t(u32, sample[1 + i], led_max_level);
+
+	mutex_lock(&led_schedule_mutex);
+
+	if (!led_engine_ready) {
+		mutex_unlock(&led_schedule_mutex);
+		return -ENODEV;
+	}
+
+	slot = led_stream_head % LED_STREAM_DEPTH;
+	build_led_schedule(&led_stream_schedules[slot], levels);
+	led_stream_periods[slot] = max_t(u32, sample[0], 1);
+
+	mutex_unlock(&led_schedule_mutex);
+
+	smp_store_release(&led_stream_head, led_stream_head + 1);
+
+	return 0;
+}
+
+static int setup_pwm_led_thread(void)
+{
+	struct sched_param param = { .sched_priority = PWM_THREAD_PRIORITY };
+	struct task_struct *thread;
+	int ret;
+
+	if (pwm_thread_cpu >= 0 &&
+	    (pwm_thread_cpu >= nr_cpu_ids || !cpu_online(pwm_thread_cpu))) {
+		pr_err("%s: %s (%d): Invalid CPU for the PWM thread (%d)\n",
+			MODULE_NAME,
+			__func__,
+			__LINE__,
+			pwm_thread_cpu);
+		return -EINVAL;
+	}
+
+	thread = kthread_create(led_ctrl_thread, NULL, "pwm-led");
+	if (IS_ERR(thread)) {
+		pr_err("%s: %s (%d): Failed to create the PWM thread\n",
+			MODULE_NAME,
+			__func__,
+			__LINE__);
+		return PTR_ERR(thread);
+	}
+
+	if (pwm_thread_cpu >= 0)
+		kthread_bind(thread, pwm_thread_cpu);
+
+	ret = sched_setscheduler(thread, SCHED_FIFO, &param);
+	if (ret < 0)
+		pr_warn("%s: %s (%d): Failed to make the PWM thread SCHED_FIFO\n",
+			MODULE_NAME,
+			__func__,
+			__LINE__);
+
+	led_thread = thread;
+	wake_up_process(led_thread);
+
+	/* The thread measures its own wake-up latency first */
+	wait_for_completion(&calibration_done);
+
+	return 0;
+}
+
+/*
+ * Arms a timer CALIBRATION_SAMPLES times and records the best and the worst
+ * latency (ns) between a deadline and the start of the timer callback.
+ */
+static void measure_timer_latency(void)
+{
+	calibration_min_latency = U64_MAX;
+	calibration_max_latency = 0;
+	calibration_samples = 0;
+	calibration_deadline = pwm_led_now() + CALIBRATION_INTERVAL;
+
+	hrtimer_init(&calibration_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	calibration_timer.function = calibration_timer_func;
+	hrtimer_start(&calibration_timer,
+			ns_to_ktime(calibration_deadline),
+			HRTIMER_MODE_ABS);
+
+	wait_for_completion(&calibration_done);
+	hrtimer_cancel(&calibration_timer);
+}
+
+static enum hrtimer_restart calibration_timer_func(struct hrtimer *timer)
+{
+	u64 now, latency;
+
+	now = pwm_led_now();
+	latency = now - calibration_deadline;
+	calibration_min_latency = min(calibration_min_latency, latency);
+	calibration_max_latency = max(calibration_max_latency, latency);
+
+	if (++calibration_samples == CALIBRATION_SAMPLES) {
+		complete(&calibration_done);
+		return HRTIMER_NORESTART;
+	}
+
+	calibration_deadline = now + CALIBRATION_INTERVAL;
+	hrtimer_set_expires(timer, ns_to_ktime(calibration_deadline));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Same as measure_timer_latency(), but for the calling thread.
+ */
+static void measure_thread_latency(void)
+{
+	ktime_t expires;
+	u64 deadline, latency;
+	int i;
+
+	calibration_min_latency = U64_MAX;
+	calibration_max_latency = 0;
+
+	for (i = 0; i < CALIBRATION_SAMPLES; i++) {
+		deadline = pwm_led_now() + CALIBRATION_INTERVAL;
+		expires = ns_to_ktime(deadline);
+
+		set_current_state(TASK_UNINTERRUPTIBLE);
+		schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS);
+
+		latency = pwm_led_now() - deadline;
+		calibration_min_latency = min(calibration_min_latency, latency);
+		calibration_max_latency = max(calibration_max_latency, latency);
+	}
+}
+
+/*
+ * Returns the average time (ns) it takes to write the LED channels in mask
+ * at once. The LEDs are still off, so writing LOW again has no visible
+ * effect.
+ */
+static u64 measure_write_cost(u32 mask)
+{
+	u64 start;
+	int i, count;
+
+	count = 0;
+	for (i = 0; i < num_led_channels; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+
+		led_edge_descs[count] = led_channels[i].desc;
+		led_edge_values[count] = LOW;
+		count++;
+	}
+
+	start = pwm_led_now();
+	for (i = 0; i < CALIBRATION_SAMPLES; i++)
+		gpiod_set_array_value_cansleep(count,
+						led_edge_descs,
+						led_edge_values);
+
+	return div_u64(pwm_led_now() - start, CALIBRATION_SAMPLES);
+}
+
+/*
+ * Groups the LED channels by GPIO controller and measures the write cost of
+ * each controller on its own.
+ */
+static void init_led_chips(void)
+{
+	struct gpio_chip *chip;
+	int i, j;
+
+	for (i = 0; i < num_led_channels; i++) {
+		chip = gpiod_to_chip(led_channels[i].desc);
+		for (j = 0; j < num_led_chips; j++) {
+			if (led_chips[j].chip == chip)
+				break;
+		}
+
+		if (j == num_led_chips) {
+			led_chips[j].chip = chip;
+			num_led_chips++;
+		}
+
+		led_chips[j].mask |= BIT(i);
+		led_channels[i].chip = j;
+	}
+
+	for (j = 0; j < num_led_chips; j++)
+		led_chips[j].write_cost = measure_write_cost(led_chips[j].mask);
+}
+
+/*
+ * Derives the margin for precise edges and the shortest pulse the engine can
+ * reliably produce from the measured wake-up latency and GPIO write cost.
+ * Edges closer to each other than the shortest pulse are merged when the
+ * schedule is built, so the achievable resolution is reported here.
+ */
+static void calibrate_pwm_led(void)
+{
+	u64 write_cost, jitter;
+	u32 steps;
+
+	init_led_chips();
+
+	write_cost = measure_write_cost(U32_MAX >> (32 - num_led_channels));
+	jitter = calibration_max_latency - calibration_min_latency;
+
+	pr_info("%s: Wake-up latency %llu-%llu ns, GPIO write %llu ns\n",
+		MODULE_NAME,
+		calibration_min_latency,
+		calibration_max_latency,
+		write_cost);
+
+	if (precise_edges) {
+		if (!precision_margin)
+			precision_margin = min_t(u64, calibration_max_latency,
+						PRECISION_MARGIN_MAX);
+
+		led_margin = min_t(u64, precision_margin, PRECISION_MARGIN_MAX);
+		pr_info("%s: Waking up %llu ns before each edge\n",
+			MODULE_NAME,
+			led_margin);
+	}
+
+	/* Without precise edges, the wake-up jitter limits the edge spacing */
+	if (!min_pulse)
+		min_pulse = min_t(u64, write_cost + (led_margin ? 0 : jitter),
+					pulse_frequency);
+	if (!min_pulse)
+		min_pulse = 1;
+
+	steps = pulse_frequency / min_pulse;
+	pr_info("%s: Shortest pulse %u ns, %u duty cycle steps\n",
+		MODULE_NAME,
+		min_pulse,
+		steps);
+
+	if (led_max_level > steps)
+		pr_warn("%s: led_max_level %d exceeds the %u achievable steps, levels will be quantized\n",
+			MODULE_NAME,
+			led_max_level,
+			steps);
+}
+
+/*
+ * The stats file shows the measured write cost of each GPIO controller and
+ * how much each edge of the current schedule has been moved to make up for
+ * it. Failing to create it is not fatal.
+ */
+static void setup_pwm_led_debugfs(void)
+{
+	pwm_led_debugfs = debugfs_create_dir("pwm-led", NULL);
+	if (IS_ERR_OR_NULL(pwm_led_debugfs))
+		return;
+
+	debugfs_create_file("stats", S_IRUGO, pwm_led_debugfs, NULL,
+				&pwm_led_stats_fops);
+}
+
+static int pwm_led_stats_show(struct seq_file *s, void *data)
+{
+	struct led_edge *edge;
+	int fsm, i;
+
+	/* A single load gives a consistent state and level */
+	fsm = atomic_read(&led_fsm);
+	seq_printf(s, "buttons: state %d, level %d\n",
+			LED_FSM_STATE(fsm),
+			LED_FSM_LEVEL(fsm));
+
+	seq_printf(s, "min_pulse: %u ns\n", min_pulse);
+	seq_printf(s, "wakeup_latency: %llu-%llu ns\n",
+			calibration_min_latency,
+			calibration_max_latency);
+
+	for (i = 0; i < num_led_chips; i++)
+		seq_printf(s, "chip %s: channels 0x%08x, write cost %u ns\n",
+				led_chips[i].chip->label,
+				led_chips[i].mask,
+				led_chips[i].write_cost);
+
+	mutex_lock(&led_schedule_mutex);
+
+	seq_printf(s, "stream_underruns: %u\n",
+			READ_ONCE(led_stream_underruns));
+	seq_printf(s, "period: %u ns\n", led_published_schedule->period);
+	for (i = 0; i < led_published_schedule->num_edges; i++) {
+		edge = &led_published_schedule->edges[i];
+		seq_printf(s, "edge %d: %u ns (corrected by %d ns)\n",
+				i,
+				edge->time,
+				edge->correction);
+	}
+
+	mutex_unlock(&led_schedule_mutex);
+
+	return 0;
+}
+
+static int pwm_led_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, pwm_led_stats_show, inode->i_private);
+}
+
+/*
+ * Runs with interrupts off, possibly on the CPU of the PWM timer, so it only
+ * takes the time of the press. With IRQF_ONESHOT the IRQ stays masked until
+ * the IRQ thread is done.
+ */
+static irqreturn_t button_irq_handler(int irq, void *data)
+{
+	struct led_button *button = data;
+
+	button->timestamp = pwm_led_now();
+	button->stamped = true;
+	return IRQ_WAKE_THREAD;
+}
+
+/*
+ * The IRQ thread of a button: debounces it, runs the FSM and applies the new
+ * level. Unless the GPIO controller debounces the button, the IRQ stays
+ * masked until the debounce time after the press is over, no matter how late
+ * the thread runs. The handler never runs for IRQs of nested-thread
+ * controllers (e.g. I2C GPIO expanders), so the thread takes the time then.
+ *
+ * An edge which arrives while the IRQ is masked is not lost but replayed
+ * once it is unmasked, which only happens after the button has been
+ * released. Such an edge finds the button released and is not a press.
+ */
+static irqreturn_t button_irq_thread(int irq, void *data)
+{
+	struct led_button *button = data;
+	unsigned int debounce;
+
+	if (!button->stamped)
+		button->timestamp = pwm_led_now();
+	button->stamped = false;
+
+	debounce = READ_ONCE(debounce_time);
+	if (!READ_ONCE(button->hw_debounce) && debounce) {
+		disable_irq_nosync(irq);
+		schedule_button_unmask(button, button->timestamp + debounce);
+
+		if (!button_pressed(button))
+			return IRQ_HANDLED;
+	}
+
+	apply_button_event(button->event);
+	update_button_level();
+
+	return IRQ_HANDLED;
+}
+
+/*
+ * Unmasking may take the bus lock of the GPIO controller, which sleeps, so it
+ * is left to a work. Jiffies are rounded up, the IRQ is never unmasked early.
+ */
+static void schedule_button_unmask(struct led_button *button, u64 deadline)
+{
+	unsigned long delay;
+	u64 now;
+
+	delay = 0;
+	now = pwm_led_now();
+	if (deadline > now)
+		delay = nsecs_to_jiffies(deadline - now) + 1;
+
+	schedule_delayed_work(&button->debounce_work, delay);
+}
+
+/*
+ * Keeps the IRQ masked while the button is held, so that bounces of the
+ * press and of the release are absorbed together.
+ */
+static void button_debounce_func(struct work_struct *work)
+{
+	struct led_button *button;
+	unsigned int debounce;
+
+	button = container_of(to_delayed_work(work), struct led_button,
+				debounce_work);
+
+	debounce = READ_ONCE(debounce_time);
+	if (debounce && gpio_get_value_cansleep(button->gpio)) {
+		schedule_button_unmask(button, pwm_led_now() + debounce);
+		return;
+	}
+
+	enable_irq(button->irq);
+}
+
+/*
+ * The contacts may still bounce right after the edge, so a button which
+ * reads released is sampled a few more times before it is taken as such.
+ */
+static bool button_pressed(struct led_button *button)
+{
+	int i;
+
+	for (i = 0; i < BUTTON_SAMPLES; i++) {
+		if (gpio_get_value_cansleep(button->gpio))
+			return true;
+
+		usleep_range(BUTTON_SAMPLE_INTERVAL,
+				2 * BUTTON_SAMPLE_INTERVAL);
+	}
+
+	return false;
+}
+
+/*
+ * Runs the FSM transition for a press. The state and the level are updated
+ * together with a single compare-and-swap, so presses handled by the threads
+ * of both buttons at once are each applied exactly once.
+ */
+static void apply_button_event(enum event event)
+{
+	int old, new, level;
+
+	do {
+		old = atomic_read(&led_fsm);
+		level = fsm_functions[LED_FSM_STATE(old)][event](
+				LED_FSM_LEVEL(old));
+		new = LED_FSM(led_state_for_level(level), level);
+	} while (atomic_cmpxchg(&led_fsm, old, new) != old);
+}
+
+/*
+ * Applies the button level to the channels, rebuilds the schedule and
+ * reports it. Serialized, as the threads of both buttons may call it.
+ */
+static void update_button_level(void)
+{
+	int level, led_brightness_percent, i;
+
+	mutex_lock(&led_button_level_mutex);
+
+	level = LED_FSM_LEVEL(atomic_read(&led_fsm));
+	if (level != led_button_level) {
+		led_button_level = level;
+
+		/*
+		 * The buttons control the brightness of all channels which
+		 * have not been requested through the pwm_chip
+		 */
+		for (i = 0; i < num_led_channels; i++) {
+			if (!led_channels[i].pwm)
+				WRITE_ONCE(led_channels[i].level, level);
+		}
+
+		update_led_schedule();
+	}
+
+	led_brightness_percent = div_u64(100ULL * level, led_max_level);
+
+	pr_info("%s: LED brightness %d%% (level %d)\n",
+		MODULE_NAME,
+		led_brightness_percent,
+		level);
+
+	mutex_unlock(&led_button_level_mutex);
+}
+
+static enum led_state led_state_for_level(int level)
+{
+	if (level == LED_MIN_LEVEL)
+		return OFF;
+	else if (level == led_max_level)
+		return MAX;
+	else
+		return ON;
+}
+
+static int increase_led_brightness(int level)
+{
+	return level + 1;
+}
+
+static int decrease_led_brightness(int level)
+{
+	return level - 1;
+}
+
+/*
+ * Runs the engine from the hrtimer callback, re-arming the timer for the
+ * deadline of the next step.
+ */
+static enum hrtimer_restart led_ctrl_func(struct hrtimer *timer)
+{
+	u64 deadline;
+
+	wait_for_led_deadline();
+
+	deadline = led_ctrl_step();
+	if (!deadline)
+		return HRTIMER_NORESTART;
+
+	led_deadline = deadline;
+	hrtimer_set_expires(timer, ns_to_ktime(deadline - led_margin));
+	return HRTIMER_RESTART;
+}
+
+/*
+ * Same as the timer, except that the thread sleeps until each deadline.
+ * When the engine is parked, the thread sleeps until it is woken up by
+ * wake_led_engine().
+ */
+static int led_ctrl_thread(void *data)
+{
+	ktime_t expires;
+	u64 deadline;
+
+	measure_thread_latency();
+	complete(&calibration_done);
+
+	deadline = 0;
+	while (!kthread_should_stop()) {
+		if (!deadline) {
+			set_current_state(TASK_INTERRUPTIBLE);
+			if (atomic_read(&led_engine_parked)) {
+				if (!kthread_should_stop())
+					schedule();
+				continue;
+			}
+
+			__set_current_state(TASK_RUNNING);
+			led_next_edge = LED_PERIOD_START;
+			led_period_start = pwm_led_now();
+			deadline = led_period_start;
+		}
+
+		set_current_state(TASK_INTERRUPTIBLE);
+		led_deadline = deadline;
+		expires = ns_to_ktime(deadline - led_margin);
+		if (schedule_hrtimeout_range(&expires, 0, HRTIMER_MODE_ABS))
+			continue;
+
+		wait_for_led_deadline();
+		deadline = led_ctrl_step();
+	}
+
+	__set_current_state(TASK_RUNNING);
+	return 0;
+}
+
+/*
+ * Called at the start of every period and on every edge within it. Edges are
+ * scheduled at absolute deadlines derived from the start of the current
+ * period, so a late edge only shortens the interval until the next one
+ * instead of stretching the rest of the waveform.
+ *
+ * Returns the deadline (CLOCK_MONOTONIC, ns) of the next step, or 0 if the
+ * engine has been parked.
+ */
+static u64 led_ctrl_step(void)
+{
+	struct led_edge *edge;
+	u64 now;
+
+	if (led_next_edge == LED_PERIOD_START) {
+		poll_led_table();
+		latch_led_schedule();
+		if (!led_schedule->num_edges && !led_schedule->dither_mask &&
+		    !led_stream_sample && !READ_ONCE(led_table_mapped)) {
+			set_led_outputs(led_schedule->start_masks[DITHER_ALL]);
+			if (park_led_engine())
+				return 0;
+
+			led_period_start = pwm_led_now();
+			return led_period_start;
+		}
+
+		/* Drop whole periods which have been missed altogether */
+		now = pwm_led_now();
+		if (now >= led_period_start + led_schedule->period)
+			led_period_start += led_schedule->period *
+				div_u64(now - led_period_start,
+					led_schedule->period);
+
+		led_dither_extra = next_led_dither_extra();
+		set_led_outputs(select_led_mask(led_schedule->start_masks));
+		led_next_edge = 0;
+	} else {
+		edge = &led_schedule->edges[led_next_edge++];
+		set_led_outputs(led_outputs ^ select_led_mask(edge->masks));
+	}
+
+	/* Edges of dithered channels may not apply to this period */
+	while (led_next_edge < led_schedule->num_edges &&
+	       !select_led_mask(led_schedule->edges[led_next_edge].masks))
+		led_next_edge++;
+
+	if (led_next_edge < led_schedule->num_edges)
+		return led_period_start + led_schedule->edges[led_next_edge].time;
+
+	led_next_edge = LED_PERIOD_START;
+	led_period_start += led_schedule->period;
+	return led_period_start;
+}
+
+/*
+ * Parks the engine while all channels are static (fully off or fully on).
+ * Everything which needs the engine is stored before wake_led_engine() is
+ * called, so it is checked again once the flag is visible: if a new schedule
+ * has been published, a stream has started or is closing or the table has
+ * been mapped in the meantime, whoever clears the flag first takes care of
+ * restarting the engine. Returns false if the engine has to keep running.
+ */
+static bool park_led_engine(void)
+{
+	int stream;
+
+	atomic_set(&led_engine_parked, 1);
+	smp_mb();
+
+	stream = atomic_read(&led_stream_state);
+	if (!(atomic_read(&led_schedule_middle) & LED_SCHEDULE_FRESH) &&
+	    stream != LED_STREAM_ACTIVE && stream != LED_STREAM_CLOSING &&
+	    !READ_ONCE(led_table_mapped))
+		return true;
+
+	return !atomic_xchg(&led_engine_parked, 0);
+}
+
+/*
+ * Restarts the engine if it has been parked. The thread restarts the period
+ * on its own once woken up.
+ */
+static void wake_led_engine(void)
+{
+	if (!atomic_xchg(&led_engine_parked, 0))
+		return;
+
+	if (led_thread) {
+		wake_up_process(led_thread);
+		return;
+	}
+
+	led_next_edge = LED_PERIOD_START;
+	led_period_start = pwm_led_now();
+	led_deadline = led_period_start;
+	hrtimer_start(&led_timer,
+			ns_to_ktime(led_period_start),
+			HRTIMER_MODE_ABS);
+}
+
+/*
+ * With precise edges the engine wakes up led_margin early and busy-waits
+ * for the rest of the time, which is much more accurate than the wake-up.
+ */
+static void wait_for_led_deadline(void)
+{
+	if (!led_margin)
+		return;
+
+	while (pwm_led_now() < led_deadline)
+		cpu_relax();
+}
+
+/*
+ * Writes only the channels whose value differs from the last written one.
+ * The GPIOs are never read back, which may be slow on some controllers.
+ * All changed channels are written with one call, so GPIOs sharing a
+ * controller are updated together (usually with a single register write).
+ */
+static void set_led_outputs(u32 outputs)
+{
+	u32 changed;
+	int i, count;
+
+	changed = outputs ^ led_outputs;
+	if (!changed)
+		return;
+
+	count = 0;
+	while (changed) {
+		i = __ffs(changed);
+		led_edge_descs[count] = led_channels[i].desc;
+		led_edge_values[count] = !!(outputs & BIT(i));
+		count++;
+		changed &= changed - 1;
+	}
+
+	if (led_thread)
+		gpiod_set_array_value_cansleep(count, led_edge_descs,
+						led_edge_values);
+	else
+		gpiod_set_array_value(count, led_edge_descs, led_edge_values);
+	led_outputs = outputs;
+}
+
+/*
+ * Combines the masks of an edge (or of the start of the period) which apply
+ * to the current period.
+ */
+static u32 select_led_mask(const u32 *masks)
+{
+	return masks[DITHER_ALL] |
+		(masks[DITHER_BASE] & ~led_dither_extra) |
+		(masks[DITHER_EXTRA] & led_dither_extra);
+}
+
+/*
+ * First-order sigma-delta modulation: every period each dithered channel
+ * accumulates its fraction, and gets the extra quantum whenever the
+ * accumulator overflows.
+ */
+static u32 next_led_dither_extra(void)
+{
+	u32 channels, extra;
+	int i;
+
+	extra = 0;
+	channels = led_schedule->dither_mask;
+	while (channels) {
+		i = __ffs(channels);
+		led_dither_acc[i] += led_schedule->dither_frac[i];
+		if (led_dither_acc[i] >= DITHER_ONE) {
+			led_dither_acc[i] -= DITHER_ONE;
+			extra |= BIT(i);
+		}
+		channels &= channels - 1;
+	}
+
+	return extra;
+}
+
+/*
+ * Takes over the most recently published schedule. Only called at the start
+ * of a period, so level changes never produce runt pulses.
+ */
+static void latch_led_schedule(void)
+{
+	if (atomic_read(&led_schedule_middle) & LED_SCHEDULE_FRESH)
+		led_schedule_front = atomic_xchg(&led_schedule_middle,
+						led_schedule_front) &
+					~LED_SCHEDULE_FRESH;
+
+	led_schedule = &led_schedules[led_schedule_front];
+
+	latch_led_stream();
+	if (led_stream_sample)
+		led_schedule = led_stream_sample;
+}
+
+/*
+ * While a stream is active, its samples take the place of the schedule built
+ * from the channel levels. The slot of the sample being played is only handed
+ * back to the writer once the engine has moved on to the next one.
+ */
+static void latch_led_stream(void)
+{
+	unsigned int next;
+
+	switch (atomic_read(&led_stream_state)) {
+	case LED_STREAM_ACTIVE:
+		break;
+	case LED_STREAM_CLOSING:
+		led_stream_sample = NULL;
+		led_stream_hold = 0;
+		smp_store_release(&led_stream_tail,
+				smp_load_acquire(&led_stream_head));
+		atomic_set(&led_stream_state, LED_STREAM_IDLE);
+		return;
+	default:
+		return;
+	}
+
+	if (led_stream_hold) {
+		led_stream_hold--;
+		return;
+	}
+
+	next = led_stream_tail + (led_stream_sample ? 1 : 0);
+	if (next == smp_load_acquire(&led_stream_head)) {
+		if (led_stream_sample)
+			WRITE_ONCE(led_stream_underruns,
+					led_stream_underruns + 1);
+		return;
+	}
+
+	led_stream_sample = &led_stream_schedules[next % LED_STREAM_DEPTH];
+	led_stream_hold = led_stream_periods[next % LED_STREAM_DEPTH] - 1;
+	smp_store_release(&led_stream_tail, next);
+	wake_up_interruptible(&led_stream_wait);
+}
+
+/*
+ * Builds the schedule for the current channel levels and publishes it to the
+ * timer. All arithmetic is done here, when a level changes, so the timer only
+ * has to walk the sorted edges.
+ */
+static void update_led_schedule(void)
+{
+	struct led_schedule *schedule;
+	int levels[MAX_LED_CHANNELS];
+	int back, i;
+
+	mutex_lock(&led_schedule_mutex);
+
+	if (!led_engine_ready) {
+		mutex_unlock(&led_schedule_mutex);
+		return;
+	}
+
+	for (i = 0; i < num_led_channels; i++)
+		levels[i] = READ_ONCE(led_channels[i].level);
+
+	schedule = &led_schedules[led_schedule_back];
+	build_led_schedule(schedule, levels);
+
+	/* Period and edges become visible to the engine together */
+	back = atomic_xchg(&led_schedule_middle,
+			led_schedule_back | LED_SCHEDULE_FRESH);
+	led_schedule_back = back & ~LED_SCHEDULE_FRESH;
+	led_published_schedule = schedule;
+
+	mutex_unlock(&led_schedule_mutex);
+
+	wake_led_engine();
+}
+
+/*
+ * Builds the schedule of a period in which the channels have the given
+ * levels. Must be called with the schedule mutex held.
+ */
+static void build_led_schedule(struct led_schedule *schedule,
+			const int *levels)
+{
+	memset(schedule, 0, sizeof(*schedule));
+	schedule->period = READ_ONCE(pulse_frequency);
+
+	if (bam_mode)
+		build_bam_schedule(schedule, levels);
+	else
+		build_pwm_schedule(schedule, levels);
+
+	compensate_write_cost(schedule);
+}
+
+/*
+ * PWM: every channel goes HIGH at its phase offset and LOW once its HIGH time
+ * is over. When dithering, a channel whose HIGH time falls between two
+ * quanta gets two alternative windows, one a quantum longer than the other.
+ */
+static void build_pwm_schedule(struct led_schedule *schedule,
+			const int *levels)
+{
+	u32 period, quantum, high_time, phase, frac, base, extra;
+	int i;
+
+	period = schedule->period;
+	if (!period)
+		return;
+
+	/*
+	 * A quantum shorter than min_pulse would merge the two alternative
+	 * end edges into one
+	 */
+	quantum = 0;
+	if (dither)
+		quantum = max_t(u32, dither_quantum, min_pulse);
+	if (quantum >= period)
+		quantum = 0;
+
+	for (i = 0; i < num_led_channels; i++) {
+		high_time = led_high_time(&led_channels[i], levels[i], period,
+					quantum, &frac);
+		phase = led_phase(i, period);
+
+		base = clamp_led_pulse(high_time, period);
+		extra = frac ? clamp_led_pulse(high_time + quantum, period) : base;
+
+		/* Both windows may be rounded to the same pulse */
+		if (base == extra) {
+			add_led_window(schedule, BIT(i), phase, base,
+					DITHER_ALL);
+			continue;
+		}
+
+		add_led_window(schedule, BIT(i), phase, base, DITHER_BASE);
+		add_led_window(schedule, BIT(i), phase, extra, DITHER_EXTRA);
+
+		schedule->dither_mask |= BIT(i);
+		schedule->dither_frac[i] = frac;
+	}
+}
+
+/*
+ * Bit-angle modulation: the period is split into one slot per bit of the
+ * level, each twice as long as the previous one. During slot k the channels
+ * whose value has bit k set are HIGH, so there are at most as many edges per
+ * period as there are bits, regardless of the number of channels.
+ */
+static void build_bam_schedule(struct led_schedule *schedule,
+			const int *levels)
+{
+	u32 slot_masks[MAX_LED_CHANNELS];
+	u32 max_value, value, time;
+	int bits, i, k;
+
+	bits = fls(led_max_level);
+	if (!bits)
+		return;
+
+	max_value = BIT(bits) - 1;
+	memset(slot_masks, 0, sizeof(slot_masks));
+
+	for (i = 0; i < num_led_channels; i++) {
+		value = led_bam_value(&led_channels[i], levels[i],
+					schedule->period, max_value);
+		for (k = 0; k < bits; k++) {
+			if (value & BIT(k))
+				slot_masks[k] |= BIT(i);
+		}
+	}
+
+	schedule->start_masks[DITHER_ALL] = slot_masks[0];
+	for (k = 1; k < bits; k++) {
+		if (slot_masks[k] == slot_masks[k - 1])
+			continue;
+
+		time = div_u64((u64)schedule->period * (BIT(k) - 1), max_value);
+		add_led_edge(schedule, time, slot_masks[k] ^ slot_masks[k - 1],
+				DITHER_ALL);
+	}
+}
+
+/*
+ * Adds the edges of channels which are HIGH for length nanoseconds from
+ * start. A HIGH part which does not fit before the end of the period wraps
+ * around to its start. The start masks are toggled like the edges, so that
+ * edges folded into the start of the period (see add_led_edge()) add up.
+ */
+static void add_led_window(struct led_schedule *schedule, u32 mask,
+			u32 start, u32 length, enum dither_kind kind)
+{
+	u32 end;
+
+	if (!length)
+		return;
+
+	if (length >= schedule->period) {
+		schedule->start_masks[kind] ^= mask;
+		return;
+	}
+
+	end = start + length;
+	if (!start) {
+		schedule->start_masks[kind] ^= mask;
+	} else {
+		add_led_edge(schedule, start, mask, kind);
+		if (end > schedule->period) {
+			schedule->start_masks[kind] ^= mask;
+			end -= schedule->period;
+		}
+	}
+
+	if (end < schedule->period)
+		add_led_edge(schedule, end, mask, kind);
+}
+
+/*
+ * Inserts an edge keeping the edges sorted. The engine cannot produce
+ * pulses shorter than min_pulse, so an edge that close to another one is
+ * merged into it, an edge that close to the start of the period is folded
+ * into the start masks and one that close to its end is dropped (the start
+ * masks of the next period apply right after it anyway).
+ */
+static void add_led_edge(struct led_schedule *schedule, u32 time, u32 mask,
+			enum dither_kind kind)
+{
+	int i;
+
+	if (time < min_pulse) {
+		schedule->start_masks[kind] ^= mask;
+		return;
+	}
+
+	if (schedule->period - time < min_pulse)
+		return;
+
+	for (i = 0; i < schedule->num_edges; i++) {
+		if (schedule->edges[i].time + min_pulse > time &&
+		    time + min_pulse > schedule->edges[i].time) {
+			schedule->edges[i].masks[kind] ^= mask;
+			return;
+		}
+
+		if (schedule->edges[i].time > time)
+			break;
+	}
+
+	memmove(&schedule->edges[i + 1],
+		&schedule->edges[i],
+		(schedule->num_edges - i) * sizeof(*schedule->edges));
+
+	memset(&schedule->edges[i], 0, sizeof(*schedule->edges));
+	schedule->edges[i].time = time;
+	schedule->edges[i].masks[kind] = mask;
+	schedule->num_edges++;
+}
+
+/*
+ * Returns the HIGH time of a channel at a level. With a non-zero quantum it
+ * is rounded down to a multiple of the quantum and frac is set to the
+ * remaining part of a quantum (in 1/DITHER_ONE), which is made up for by
+ * dithering.
+ */
+static u32 led_high_time(const struct led_channel *channel, int level,
+			u32 period, u32 quantum, u32 *frac)
+{
+	u32 exact, remainder, high_time;
+
+	*frac = 0;
+	remainder = 0;
+	if (channel->pwm)
+		exact = led_pwm_high_time(channel, period);
+	else if (level >= led_max_level)
+		return period;
+	else
+		exact = div_u64_rem((u64)period * level,
+					led_max_level, &remainder);
+
+	if (!quantum || exact == period)
+		return exact;
+
+	high_time = exact - exact % quantum;
+	*frac = div_u64(((u64)(exact - high_time) << DITHER_SHIFT) +
+			div_u64((u64)remainder << DITHER_SHIFT, led_max_level),
+			quantum);
+
+	return high_time;
+}
+
+/*
+ * A GPIO only changes once it has been written. gpiolib writes the
+ * controllers of a write one after another, in the order of the channels,
+ * so a channel changes once its own controller and all those before it have
+ * been written. Every edge is moved by the difference between when its
+ * channels change in the write at the start of the period and when they
+ * change in its own write, keeping the time between a channel's edges (i.e.
+ * its duty cycle) as requested. An edge whose channels need different
+ * corrections is split up while there is room, so that each part writes a
+ * single controller. Edges of
+ * dithered channels are assumed to write all of their channels.
+ */
+static void compensate_write_cost(struct led_schedule *schedule)
+{
+	u32 start_offsets[MAX_LED_CHANNELS], offsets[MAX_LED_CHANNELS];
+	struct led_edge edge;
+	u32 toggled, masks, rest, group;
+	s32 correction;
+	int num_edges, num_groups, i, j, k;
+
+	toggled = 0;
+	for (i = 0; i < schedule->num_edges; i++)
+		for (j = 0; j < NUM_DITHER_KINDS; j++)
+			toggled |= schedule->edges[i].masks[j];
+
+	masks = 0;
+	for (j = 0; j < NUM_DITHER_KINDS; j++)
+		masks |= schedule->start_masks[j];
+
+	led_write_offsets(masks & toggled, start_offsets);
+
+	num_edges = schedule->num_edges;
+	for (i = 0; i < num_edges; i++) {
+		masks = 0;
+		for (j = 0; j < NUM_DITHER_KINDS; j++)
+			masks |= schedule->edges[i].masks[j];
+
+		if (!masks)
+			continue;
+
+		led_write_offsets(masks, offsets);
+
+		num_groups = 0;
+		for (rest = masks; rest;
+		     rest &= ~led_edge_group(rest, start_offsets))
+			num_groups++;
+
+		j = __ffs(masks);
+		correction = start_offsets[j] - offsets[j];
+		for (rest = masks; rest; rest &= rest - 1) {
+			j = __ffs(rest);
+			if ((s32)(start_offsets[j] - offsets[j]) != correction)
+				break;
+		}
+
+		if (!rest ||
+		    schedule->num_edges + num_groups - 1 > MAX_LED_EDGES) {
+			move_led_edge(schedule, &schedule->edges[i],
+					correction);
+			continue;
+		}
+
+		/* Each group is written on its own */
+		edge = schedule->edges[i];
+		for (rest = masks; rest; rest &= ~group) {
+			group = led_edge_group(rest, start_offsets);
+			k = rest == masks ? i : schedule->num_edges++;
+			schedule->edges[k] = edge;
+			for (j = 0; j < NUM_DITHER_KINDS; j++)
+				schedule->edges[k].masks[j] &= group;
+
+			j = __ffs(group);
+			correction = start_offsets[j] -
+				led_chips[led_channels[j].chip].write_cost;
+			move_led_edge(schedule, &schedule->edges[k], correction);
+		}
+	}
+
+	/* Keep the edges sorted, they are only moved by a little */
+	for (i = 1; i < schedule->num_edges; i++) {
+		edge = schedule->edges[i];
+		for (j = i; j > 0 && schedule->edges[j - 1].time > edge.time; j--)
+			schedule->edges[j] = schedule->edges[j - 1];
+		schedule->edges[j] = edge;
+	}
+}
+
+/*
+ * Moves an edge by correction (ns), keeping it inside the period.
+ */
+static void move_led_edge(struct led_schedule *schedule,
+			struct led_edge *edge, s32 correction)
+{
+	s64 time;
+
+	time = (s64)edge->time + correction;
+	time = clamp_t(s64, time, 1, schedule->period - 1);
+
+	edge->correction = time - edge->time;
+	edge->time = time;
+}
+
+/*
+ * Returns the channels in mask which are on the same controller as the first
+ * one and change at the same time in the write at the start of the period.
+ */
+static u32 led_edge_group(u32 mask, const u32 *start_offsets)
+{
+	u32 group;
+	int first, i;
+
+	group = 0;
+	first = __ffs(mask);
+	for (i = first; i < num_led_channels; i++) {
+		if (mask & BIT(i) &&
+		    led_channels[i].chip == led_channels[first].chip &&
+		    start_offsets[i] == start_offsets[first])
+			group |= BIT(i);
+	}
+
+	return group;
+}
+
+/*
+ * Returns the first run of channels in mask which belong to the same
+ * controller and are therefore written together.
+ */
+static u32 led_write_run(u32 mask)
+{
+	u32 run;
+	int chip, i;
+
+	run = 0;
+	chip = led_channels[__ffs(mask)].chip;
+	for (i = __ffs(mask); i < num_led_channels; i++) {
+		if (!(mask & BIT(i)))
+			continue;
+		if (led_channels[i].chip != chip)
+			break;
+		run |= BIT(i);
+	}
+
+	return run;
+}
+
+/*
+ * Stores for every channel in mask the time (ns) after which it has changed
+ * when mask is written in one go.
+ */
+static void led_write_offsets(u32 mask, u32 *offsets)
+{
+	u32 offset, run;
+	int i;
+
+	memset(offsets, 0, sizeof(*offsets) * MAX_LED_CHANNELS);
+
+	offset = 0;
+	for (; mask; mask &= ~run) {
+		run = led_write_run(mask);
+		offset += led_chips[led_channels[__ffs(run)].chip].write_cost;
+		for (i = 0; i < num_led_channels; i++) {
+			if (run & BIT(i))
+				offsets[i] = offset;
+		}
+	}
+}
+
+/*
+ * Rounds HIGH and LOW parts shorter than min_pulse to nothing or to
+ * min_pulse, whichever is closer.
+ */
+static u32 clamp_led_pulse(u32 high_time, u32 period)
+{
+	u32 low_time;
+
+	if (high_time && high_time < min_pulse)
+		return high_time < min_pulse / 2 ? 0 : min_pulse;
+
+	low_time = period - high_time;
+	if (low_time && low_time < min_pulse)
+		return low_time < min_pulse / 2 ? period : period - min_pulse;
+
+	return high_time;
+}
+
+/*
+ * Channels without an explicit phase offset are spread evenly across the
+ * period when auto_phase is set, so their edges (and current draw) do not
+ * all fall on the start of the period.
+ */
+static u32 led_phase(int channel, u32 period)
+{
+	if (channel < num_led_phases)
+		return led_phases[channel] % period;
+
+	if (auto_phase)
+		return div_u64((u64)period * channel, num_led_channels);
+
+	return 0;
+}
+
+/*
+ * Returns the HIGH time requested by the pwm_chip consumer of a channel,
+ * scaled to the period in case it has been changed since.
+ */
+static u32 led_pwm_high_time(const struct led_channel *channel, u32 period)
+{
+	u32 high_time;
+
+	if (!channel->pwm_enabled)
+		return 0;
+
+	high_time = div_u64((u64)channel->pwm_duty * period,
+				channel->pwm_period);
+
+	return channel->pwm_inversed ? period - high_time : high_time;
+}
+
+/*
+ * Maps a level (or the PWM duty cycle) of a channel to the closest value with
+ * the bit depth used by BAM.
+ */
+static u32 led_bam_value(const struct led_channel *channel, int level,
+			u32 period, u32 max_value)
+{
+	if (channel->pwm)
+		return div_u64((u64)led_pwm_high_time(channel, period) *
+				max_value + period / 2, period);
+
+	if (level >= led_max_level)
+		return max_value;
+
+	return div_u64((u64)level * max_value + led_max_level / 2,
+			led_max_level);
+}
+
+/*
+ * The single time base of the module: CLOCK_MONOTONIC in nanoseconds, which
+ * is not affected by changes of the wall clock and needs no conversions.
+ * The NMI-safe accessor does not retry on concurrent clock updates, which
+ * makes it cheaper than ktime_get().
+ */
+static u64 pwm_led_now(void)
+{
+	return ktime_get_mono_fast_ns();
 }
 
 module_init(pwm_led_init);